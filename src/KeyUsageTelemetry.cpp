@@ -0,0 +1,327 @@
+#include "KeyUsageTelemetry.h"
+
+#include <avr/eeprom.h>
+#include <stddef.h>
+#include <string.h>
+
+void KeyUsageTelemetry::begin(const Config* c) {
+  config_ = *c;
+  count_ = 0;
+  dirtyCursor_ = 0;
+  stagedBytesWritten_ = RECORD_SIZE;
+  skippedRecords_ = 0;
+  droppedCount_ = 0;
+  memset(newestRecords_, 0, sizeof(newestRecords_));
+
+  // Resume appending right after the newest record in the ring, and mark the newest record of
+  // each key. This is the only full scan of the ring; afterwards the marks are kept up to date as
+  // records are written.
+  bool found = false;
+  writeIndex_ = 0;
+  nextSequence_ = 0;
+  for (uint8_t i = 0; i < config_.RecordsCount; ++i) {
+    Record record;
+    readRecord(i, &record);
+    if (!isValid(&record)) continue;
+    if (!found || static_cast<int16_t>(record.Sequence - (nextSequence_ - 1)) > 0) {
+      found = true;
+      nextSequence_ = record.Sequence + 1;
+      writeIndex_ = (i + 1 < config_.RecordsCount) ? i + 1 : 0;
+    }
+
+    uint8_t previous = findNewest(record.KeyCode);
+    if (previous != NO_RECORD) {
+      Record other;
+      readRecord(previous, &other);
+      if (static_cast<int16_t>(record.Sequence - other.Sequence) <= 0) continue;
+      setNewestRecord(previous, false);
+    }
+    setNewestRecord(i, true);
+  }
+
+  lastStagedAt_ = now() - config_.MinWriteIntervalTicks;
+}
+
+bool KeyUsageTelemetry::bind(const uint8_t* keyCodes, uint8_t count, const SlotMap* slots) {
+  if (count > config_.EntriesCount) return false;
+
+  slots_ = *slots;
+
+  Entry* entries = config_.Entries;
+
+  // Both the current table and keyCodes are in ascending key code order. First compact the entries
+  // of keys that stay to the front, then spread them out to their new slots from the back,
+  // filling the gaps with entries loaded from EEPROM.
+  uint8_t kept = 0;
+  uint8_t k = 0;
+  for (uint8_t i = 0; i < count_; ++i) {
+    while (k < count && keyCodes[k] < entries[i].KeyCode) ++k;
+    if (k < count && keyCodes[k] == entries[i].KeyCode) {
+      entries[kept++] = entries[i];
+    } else if (entries[i].Flags & FLAG_DIRTY) {
+      drop(&entries[i]);
+    }
+  }
+
+  for (uint8_t i = count; i-- > 0;) {
+    if (kept > 0 && entries[kept - 1].KeyCode == keyCodes[i]) {
+      entries[i] = entries[--kept];
+      continue;
+    }
+
+    memset(&entries[i], 0, sizeof(entries[i]));
+    entries[i].KeyCode = keyCodes[i];
+    entries[i].NewestRecord = findNewest(keyCodes[i]);
+
+    if (entries[i].NewestRecord != NO_RECORD) {
+      Record record;
+      readRecord(entries[i].NewestRecord, &record);
+      entries[i].Presses = record.Presses;
+      entries[i].HoldTicks = record.HoldTicks;
+    }
+
+    // A record of this key still being written is newer than the ring, and counts dropped before
+    // they were written are newer still
+    if (stagedBytesWritten_ < RECORD_SIZE && staged_.KeyCode == keyCodes[i]) {
+      entries[i].Presses = staged_.Presses;
+      entries[i].HoldTicks = staged_.HoldTicks;
+    }
+    takeDropped(keyCodes[i], &entries[i]);
+  }
+
+  count_ = count;
+  dirtyCursor_ = 0;
+
+  return true;
+}
+
+const KeyUsageTelemetry::SlotMap* KeyUsageTelemetry::slotMap() const {
+  return &slots_;
+}
+
+void KeyUsageTelemetry::recordPress(uint8_t slot) {
+  if (slot >= count_) return;
+  Entry* entry = &config_.Entries[slot];
+  ++entry->Presses;
+  entry->Flags |= FLAG_DIRTY | FLAG_HELD;
+  if (config_.Ticks) {
+    entry->PressedAt = config_.Ticks();
+  }
+}
+
+void KeyUsageTelemetry::recordRelease(uint8_t slot) {
+  if (slot >= count_) return;
+  Entry* entry = &config_.Entries[slot];
+  if ((entry->Flags & FLAG_HELD) && config_.Ticks) {
+    // Holds longer than the tick counter's wrap period are undercounted
+    entry->HoldTicks += static_cast<uint16_t>(config_.Ticks() - entry->PressedAt);
+    entry->Flags |= FLAG_DIRTY;
+  }
+  entry->Flags &= ~FLAG_HELD;
+}
+
+void KeyUsageTelemetry::service() {
+  if (config_.RecordsCount == 0) return;
+
+  // The EEPROM is still busy with the previous byte; waiting for it here would block
+  if (!eeprom_is_ready()) return;
+
+  // Continue a record in flight, one byte per call
+  if (stagedBytesWritten_ < RECORD_SIZE) {
+    writeStagedByte();
+    return;
+  }
+
+  uint16_t timestamp = now();
+  if (static_cast<uint16_t>(timestamp - lastStagedAt_) < config_.MinWriteIntervalTicks) return;
+
+  // A lap of slots that all hold some key's newest record: nothing can be written without
+  // destroying one, and none will ever become stale.
+  if (isRingFull()) return;
+
+  // Dropped keys go first: they are the only copy of their counts and hold up bind() when the
+  // dropped area fills
+  Entry* dirty = (droppedCount_ > 0) ? &dropped_[0] : nextDirtyEntry();
+  if (dirty == nullptr) return;
+
+  if (!skipNewestRecords()) return;
+
+  stage(dirty);
+  lastStagedAt_ = timestamp;
+  if (dirty == &dropped_[0]) {
+    removeDropped(0);
+  } else {
+    dirty->Flags &= ~FLAG_DIRTY;
+  }
+}
+
+bool KeyUsageTelemetry::isRingFull() const {
+  return skippedRecords_ >= config_.RecordsCount;
+}
+
+const KeyUsageTelemetry::Entry* KeyUsageTelemetry::find(uint8_t keyCode) const {
+  return findEntry(keyCode);
+}
+
+KeyUsageTelemetry::Entry* KeyUsageTelemetry::findEntry(uint8_t keyCode) const {
+  uint8_t low = 0;
+  uint8_t high = count_;
+  while (low < high) {
+    uint8_t mid = low + (high - low) / 2;
+    uint8_t midKeyCode = config_.Entries[mid].KeyCode;
+    if (midKeyCode == keyCode) return &config_.Entries[mid];
+    if (midKeyCode < keyCode) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return nullptr;
+}
+
+uint8_t* KeyUsageTelemetry::recordAddress(uint8_t index) const {
+  return reinterpret_cast<uint8_t*>(config_.EepromOffset + index * RECORD_SIZE);
+}
+
+void KeyUsageTelemetry::readRecord(uint8_t index, Record* out_record) const {
+  eeprom_read_block(out_record, recordAddress(index), RECORD_SIZE);
+}
+
+bool KeyUsageTelemetry::isValid(const Record* record) const {
+  // Erased EEPROM reads 0xFF, which is never a key code
+  if (record->KeyCode == 0 || record->KeyCode == 0xFF) return false;
+  return record->Check == checksum(record);
+}
+
+uint8_t KeyUsageTelemetry::findNewest(uint8_t keyCode) const {
+  // Only marked slots can hold a key's newest record, and only their key code byte is needed
+  for (uint8_t i = 0; i < config_.RecordsCount; ++i) {
+    if (!isNewestRecord(i)) continue;
+    uint8_t recordKeyCode;
+    eeprom_read_block(&recordKeyCode, recordAddress(i) + offsetof(Record, KeyCode),
+                      sizeof(recordKeyCode));
+    if (recordKeyCode == keyCode) return i;
+  }
+  return NO_RECORD;
+}
+
+bool KeyUsageTelemetry::isNewestRecord(uint8_t index) const {
+  return newestRecords_[index / 8] & (1 << (index % 8));
+}
+
+void KeyUsageTelemetry::setNewestRecord(uint8_t index, bool newest) {
+  if (newest) {
+    newestRecords_[index / 8] |= (1 << (index % 8));
+  } else {
+    newestRecords_[index / 8] &= ~(1 << (index % 8));
+  }
+}
+
+uint8_t KeyUsageTelemetry::checksum(const Record* record) const {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(record);
+  uint8_t sum = 0;
+  for (uint8_t i = 0; i < RECORD_SIZE; ++i) {
+    if (i == offsetof(Record, Check)) continue;
+    sum += bytes[i];
+  }
+  return ~sum;
+}
+
+KeyUsageTelemetry::Entry* KeyUsageTelemetry::nextDirtyEntry() {
+  for (uint8_t n = 0; n < count_; ++n) {
+    if (dirtyCursor_ >= count_) dirtyCursor_ = 0;
+    Entry* entry = &config_.Entries[dirtyCursor_++];
+    if (entry->Flags & FLAG_DIRTY) return entry;
+  }
+  return nullptr;
+}
+
+void KeyUsageTelemetry::drop(const Entry* entry) {
+  if (config_.RecordsCount == 0) return;
+
+  if (droppedCount_ == DROPPED_CAPACITY) writeDroppedNow();
+
+  Entry* dropped = &dropped_[droppedCount_++];
+  *dropped = *entry;
+  dropped->Flags = FLAG_DIRTY;
+}
+
+bool KeyUsageTelemetry::takeDropped(uint8_t keyCode, Entry* out_entry) {
+  for (uint8_t i = 0; i < droppedCount_; ++i) {
+    if (dropped_[i].KeyCode != keyCode) continue;
+    out_entry->Presses = dropped_[i].Presses;
+    out_entry->HoldTicks = dropped_[i].HoldTicks;
+    out_entry->Flags = FLAG_DIRTY;
+    removeDropped(i);
+    return true;
+  }
+  return false;
+}
+
+void KeyUsageTelemetry::removeDropped(uint8_t index) {
+  --droppedCount_;
+  for (uint8_t i = index; i < droppedCount_; ++i) {
+    dropped_[i] = dropped_[i + 1];
+  }
+}
+
+void KeyUsageTelemetry::writeDroppedNow() {
+  // eeprom_write_byte() waits for the previous byte, so these loops block until done
+  while (stagedBytesWritten_ < RECORD_SIZE) writeStagedByte();
+
+  // With the ring full the counts cannot be kept anywhere; they are lost as they would be in the
+  // table
+  if (!isRingFull() && skipNewestRecords()) {
+    stage(&dropped_[0]);
+    while (stagedBytesWritten_ < RECORD_SIZE) writeStagedByte();
+  }
+
+  removeDropped(0);
+}
+
+bool KeyUsageTelemetry::skipNewestRecords() {
+  // Never overwrite the only copy of a key's counters, whether or not that key is in the current
+  // layout; skip past it instead.
+  while (isNewestRecord(writeIndex_)) {
+    writeIndex_ = (writeIndex_ + 1 < config_.RecordsCount) ? writeIndex_ + 1 : 0;
+    if (++skippedRecords_ >= config_.RecordsCount) return false;
+  }
+  return true;
+}
+
+void KeyUsageTelemetry::stage(const Entry* entry) {
+  staged_.Sequence = nextSequence_;
+  staged_.KeyCode = entry->KeyCode;
+  staged_.Presses = entry->Presses;
+  staged_.HoldTicks = entry->HoldTicks;
+  staged_.Check = checksum(&staged_);
+  stagedReplaces_ = entry->NewestRecord;
+  stagedBytesWritten_ = 0;
+  skippedRecords_ = 0;
+}
+
+void KeyUsageTelemetry::writeStagedByte() {
+  // The sequence number at the front is written last, so a record torn by a reset fails its
+  // checksum instead of looking newest.
+  uint8_t offset = (stagedBytesWritten_ + sizeof(staged_.Sequence)) % RECORD_SIZE;
+  eeprom_write_byte(recordAddress(writeIndex_) + offset,
+                    reinterpret_cast<const uint8_t*>(&staged_)[offset]);
+
+  if (++stagedBytesWritten_ < RECORD_SIZE) return;
+
+  if (stagedReplaces_ != NO_RECORD) setNewestRecord(stagedReplaces_, false);
+  setNewestRecord(writeIndex_, true);
+
+  Entry* entry = findEntry(staged_.KeyCode);
+  if (entry != nullptr) entry->NewestRecord = writeIndex_;
+  for (uint8_t i = 0; i < droppedCount_; ++i) {
+    if (dropped_[i].KeyCode == staged_.KeyCode) dropped_[i].NewestRecord = writeIndex_;
+  }
+
+  ++nextSequence_;
+  writeIndex_ = (writeIndex_ + 1 < config_.RecordsCount) ? writeIndex_ + 1 : 0;
+}
+
+uint16_t KeyUsageTelemetry::now() {
+  return config_.Ticks ? config_.Ticks() : ++serviceCalls_;
+}
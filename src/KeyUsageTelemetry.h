@@ -0,0 +1,120 @@
+#ifndef KeyUsageTelemetry_h
+#define KeyUsageTelemetry_h
+
+#include <stdint.h>
+
+// Per-key press counters and hold-time accumulators with EEPROM checkpoints.
+//
+// The driver feeds recordPress() / recordRelease() from its event path, which only touches the
+// RAM table. Persistence happens in service(), called from the application's idle time: at most
+// one record is started per MinWriteIntervalTicks, and it is written one byte per call, only when
+// the EEPROM is ready, so service() never blocks.
+//
+// EEPROM holds a ring of fixed-size records (sequence number, key code, counters). Records are
+// appended round the ring so writes are spread evenly over it. Slots holding the newest record of
+// some key are skipped rather than reused, so keys outside the current layout keep their history.
+// Which slots those are is worked out once in begin() and then tracked in RAM, so service() never
+// reads the ring. The ring must hold more records than distinct keys ever recorded; once every
+// slot holds a newest record, isRingFull() reports it and nothing more is written.
+//
+// Keys that bind() drops from the table with unsaved counts are moved to a small dropped area,
+// which service() writes out before the table. Should the area be full, bind() writes its oldest
+// entry out at once, waiting on the EEPROM.
+class KeyUsageTelemetry {
+ public:
+  typedef uint16_t (*TickSource)();
+
+  struct Entry {
+    uint32_t Presses;
+    uint32_t HoldTicks;
+    uint16_t PressedAt;
+    uint8_t KeyCode;
+    uint8_t Flags;
+    uint8_t NewestRecord;
+  };
+
+  struct Config {
+    // RAM table, one entry per configured key (see TCA8418::configuredKeyCount())
+    KeyUsageTelemetry::Entry* Entries = nullptr;
+    uint8_t EntriesCount = 0;
+    // EEPROM byte address of the ring, and its length in records of RECORD_SIZE bytes
+    uint16_t EepromOffset = 0;
+    uint8_t RecordsCount = 0;
+    uint16_t MinWriteIntervalTicks = 0;
+    // Optional. Without it hold time is not accumulated and the write interval counts
+    // service() calls instead of ticks.
+    TickSource Ticks = nullptr;
+  };
+
+  // Key code to slot lookup filled in by the driver when binding, so the event path is a table
+  // lookup. Keypad slots are RowBase[row] + ColRank[col]; unconfigured entries are NO_SLOT.
+  struct SlotMap {
+    uint8_t RowBase[8];
+    uint8_t ColRank[10];
+    uint8_t GpioSlot[18];
+  };
+
+  static const uint8_t RECORD_SIZE = 12;
+  static const uint8_t NO_SLOT = 0xFF;
+  static const uint8_t NO_RECORD = 0xFF;
+
+  void begin(const Config* c);
+  bool bind(const uint8_t* keyCodes, uint8_t count, const SlotMap* slots);
+  const SlotMap* slotMap() const;
+  void recordPress(uint8_t slot);
+  void recordRelease(uint8_t slot);
+  void service();
+  bool isRingFull() const;
+  const Entry* find(uint8_t keyCode) const;
+
+ private:
+  struct Record {
+    uint16_t Sequence;
+    uint8_t KeyCode;
+    uint8_t Check;
+    uint32_t Presses;
+    uint32_t HoldTicks;
+  };
+  static_assert(sizeof(Record) == RECORD_SIZE, "Record layout must match RECORD_SIZE");
+
+  static const uint8_t FLAG_DIRTY = 0x01;
+  static const uint8_t FLAG_HELD = 0x02;
+  static const uint8_t DROPPED_CAPACITY = 4;
+
+  uint8_t* recordAddress(uint8_t index) const;
+  void readRecord(uint8_t index, Record* out_record) const;
+  bool isValid(const Record* record) const;
+  Entry* findEntry(uint8_t keyCode) const;
+  uint8_t findNewest(uint8_t keyCode) const;
+  bool isNewestRecord(uint8_t index) const;
+  void setNewestRecord(uint8_t index, bool newest);
+  uint8_t checksum(const Record* record) const;
+  Entry* nextDirtyEntry();
+  void drop(const Entry* entry);
+  bool takeDropped(uint8_t keyCode, Entry* out_entry);
+  void removeDropped(uint8_t index);
+  void writeDroppedNow();
+  bool skipNewestRecords();
+  void stage(const Entry* entry);
+  void writeStagedByte();
+  uint16_t now();
+
+  Config config_{};
+  SlotMap slots_{};
+  uint8_t count_ = 0;
+  uint8_t dirtyCursor_ = 0;
+  uint8_t writeIndex_ = 0;
+  uint16_t nextSequence_ = 0;
+  uint16_t lastStagedAt_ = 0;
+  uint16_t serviceCalls_ = 0;
+  uint8_t skippedRecords_ = 0;
+  Record staged_{};
+  uint8_t stagedBytesWritten_ = RECORD_SIZE;
+  uint8_t stagedReplaces_ = NO_RECORD;
+  // One bit per ring slot, set while the slot holds the newest record of its key
+  uint8_t newestRecords_[32];
+  Entry dropped_[DROPPED_CAPACITY];
+  uint8_t droppedCount_ = 0;
+};
+
+#endif
@@ -2,6 +2,7 @@
 
 #include <avr/interrupt.h>
 #include <string.h>
+#include <util/atomic.h>
 
 #include "twi/twi_master.h"
 
@@ -12,9 +13,11 @@
   } while (0);
 
 TCA8418::Error TCA8418::begin(const Config *c) {
-  // 4 INT_CFG - processor interrupt is deasserted for 50 μs and reassert with
-  // pending interrupts
-  TRY_ERR(writeRegister(register_t::CFG, 0b0001'0000));
+  // 4 INT_CFG - see Config::InterruptReassert. When set, INT is deasserted for 50 μs and
+  // reasserted while interrupts are still pending; when clear, INT stays low until INT_STAT is
+  // cleared.
+  TRY_ERR(writeRegister(register_t::CFG, c->InterruptReassert ? 0b0001'0000 : 0));
+  interruptReassert_ = c->InterruptReassert;
 
   if (c->Keypad.Rows != nullptr && c->Keypad.Cols != nullptr) {
     TRY_ERR(configureKeypad(&c->Keypad));
@@ -24,34 +27,184 @@ TCA8418::Error TCA8418::begin(const Config *c) {
     TRY_ERR(configureGpioInputs(&c->GpioInput));
   }
 
+  createLayout(c, &layout_);
+
+  return NO_ERROR;
+}
+
+TCA8418::Error TCA8418::apply(const Config *c) {
+  const uint8_t KE_IEN_BIT = 0;
+  const uint8_t GPI_IEN_BIT = 1;
+  const uint8_t INT_CFG_BIT = 4;
+
+  Layout next;
+  createLayout(c, &next);
+
+  const uint8_t gpioDirInput[3] = {0, 0, 0};
+  uint8_t keypadChanged[3];
+  uint8_t gpioChanged[3];
+  uint8_t gpioAdded[3];
+  uint8_t edgeChanged[3];
+  uint8_t pullupChanged[3];
+  uint8_t debounceChanged[3];
+  uint8_t roleChanged[3];
+  bool anyRoleChanged = false;
+  bool hadKeypad = false, hasKeypad = false, hadGpio = false, hasGpio = false;
+
+  for (uint8_t i = 0; i < 3; ++i) {
+    keypadChanged[i] = layout_.Keypad[i] ^ next.Keypad[i];
+    gpioChanged[i] = layout_.Gpio[i] ^ next.Gpio[i];
+    gpioAdded[i] = next.Gpio[i] & ~layout_.Gpio[i];
+    edgeChanged[i] = layout_.RisingEdge[i] ^ next.RisingEdge[i];
+    pullupChanged[i] = layout_.PullupDisabled[i] ^ next.PullupDisabled[i];
+    debounceChanged[i] = layout_.DebounceDisabled[i] ^ next.DebounceDisabled[i];
+    roleChanged[i] = keypadChanged[i] | gpioChanged[i];
+    anyRoleChanged |= roleChanged[i] != 0;
+    hadKeypad |= layout_.Keypad[i] != 0;
+    hasKeypad |= next.Keypad[i] != 0;
+    hadGpio |= layout_.Gpio[i] != 0;
+    hasGpio |= next.Gpio[i] != 0;
+  }
+
+  // Registers without a changed bit are never touched. If a write fails part way, layout_ is left
+  // as it was; calling apply() again re-diffs and the already written registers read back equal,
+  // so the retry only writes what is still missing.
+  TRY_ERR(applyRegisterTriple(register_t::KP_GPIO1, next.Keypad, keypadChanged));
+  TRY_ERR(applyRegisterTriple(register_t::GPIO_DIR1, gpioDirInput, gpioAdded));
+  TRY_ERR(applyRegisterTriple(register_t::GPIO_INT_LVL1, next.RisingEdge, edgeChanged));
+  TRY_ERR(applyRegisterTriple(register_t::GPIO_PULL1, next.PullupDisabled, pullupChanged));
+  TRY_ERR(applyRegisterTriple(register_t::DEBOUNCE_DIS1, next.DebounceDisabled, debounceChanged));
+  TRY_ERR(applyRegisterTriple(register_t::GPIO_INT_EN1, next.Gpio, gpioChanged));
+  TRY_ERR(applyRegisterTriple(register_t::GPIO_EM1, next.Gpio, gpioChanged));
+
+  uint8_t cfgData = (hasKeypad ? _BV(KE_IEN_BIT) : 0) | (hasGpio ? _BV(GPI_IEN_BIT) : 0) |
+                    (c->InterruptReassert ? _BV(INT_CFG_BIT) : 0);
+  uint8_t cfgMask = (hadKeypad != hasKeypad ? _BV(KE_IEN_BIT) : 0) |
+                    (hadGpio != hasGpio ? _BV(GPI_IEN_BIT) : 0) |
+                    (interruptReassert_ != c->InterruptReassert ? _BV(INT_CFG_BIT) : 0);
+  if (cfgMask) {
+    TRY_ERR(modifyRegister(register_t::CFG, cfgData, cfgMask));
+  }
+  interruptReassert_ = c->InterruptReassert;
+
+  // Encoders and filters on pins that changed role restart from the pins' current levels
+  uint8_t activePins[3] = {0, 0, 0};
+  if (anyRoleChanged && (encodersCount_ > 0 || gpiFiltersCount_ > 0)) {
+    TRY_ERR(readActivePins(&next, activePins));
+  }
+
+  dropChangedPendingEvents(roleChanged);
+  clearChangedKeyStates(roleChanged);
+  resetChangedGpiInputs(roleChanged, activePins);
+  layout_ = next;
+
+  if (usage_ != nullptr && anyRoleChanged) {
+    TRY_ERR(bindUsageTelemetry());
+  }
+
   return NO_ERROR;
 }
 
+void TCA8418::createLayout(const Config *c, Layout *out_layout) {
+  memset(out_layout, 0, sizeof(*out_layout));
+
+  if (c->Keypad.Rows != nullptr && c->Keypad.Cols != nullptr) {
+    for (uint8_t i = 0; i < c->Keypad.RowsCount; ++i) {
+      setBit(out_layout->Keypad, static_cast<uint8_t>(c->Keypad.Rows[i]));
+    }
+    for (uint8_t i = 0; i < c->Keypad.ColsCount; ++i) {
+      setBit(out_layout->Keypad, static_cast<uint8_t>(c->Keypad.Cols[i]));
+    }
+  }
+
+  if (c->GpioInput.Pins != nullptr) {
+    createRegisterTripleMask(c->GpioInput.Pins, c->GpioInput.PinsCount, out_layout->Gpio);
+    for (uint8_t i = 0; i < 3; ++i) {
+      out_layout->RisingEdge[i] = c->GpioInput.InterruptOnRisingEdge ? out_layout->Gpio[i] : 0;
+      out_layout->PullupDisabled[i] = c->GpioInput.EnablePullups ? 0 : out_layout->Gpio[i];
+      out_layout->DebounceDisabled[i] = c->GpioInput.EnableDebounce ? 0 : out_layout->Gpio[i];
+    }
+  }
+}
+
+TCA8418::Error TCA8418::applyRegisterTriple(register_t first_register, const uint8_t data[3],
+                                            const uint8_t mask[3]) {
+  for (uint8_t i = 0; i < 3; ++i) {
+    if (mask[i] == 0) continue;
+    auto reg = static_cast<register_t>(static_cast<uint8_t>(first_register) + i);
+    TRY_ERR(modifyRegister(reg, data[i], mask[i]));
+  }
+
+  return NO_ERROR;
+}
+
+void TCA8418::clearChangedKeyStates(const uint8_t changed_pins[3]) {
+  // A keypad key loses its state if either its row or its column changed role
+  for (uint8_t row = 0; row < KEYPAD_ROWS; ++row) {
+    bool rowChanged = readBit(changed_pins, row);
+    for (uint8_t col = 0; col < KEYPAD_COLS; ++col) {
+      if (rowChanged || readBit(changed_pins, KEYPAD_ROWS + col)) {
+        clearKeyState(row * KEYPAD_COLS + col);
+      }
+    }
+  }
+
+  for (uint8_t pin = 0; pin < PIN_COUNT; ++pin) {
+    if (readBit(changed_pins, pin)) {
+      clearKeyState(GPIO_ARRAY_OFFSET + pin);
+    }
+  }
+}
+
+void TCA8418::dropChangedPendingEvents(const uint8_t changed_pins[3]) {
+  // Queued events carry key codes of the old layout; drop those on pins that changed role so
+  // updateButtonStates() does not restore their state or fire callbacks for them.
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uint8_t kept = 0;
+    for (uint8_t i = 0; i < pendingEventsCount; ++i) {
+      uint8_t rawKeyCode = pendingEvents[i] & 0b0111'1111;
+      auto type = classifyKeycode(rawKeyCode);
+
+      bool changed = false;
+      if (type == keycode_type_t::KEYPAD) {
+        uint8_t row, col;
+        splitKeypadKeyCode(rawKeyCode, &row, &col);
+        changed = readBit(changed_pins, row) || readBit(changed_pins, KEYPAD_ROWS + col);
+      } else if (type == keycode_type_t::GPIO) {
+        changed = readBit(changed_pins, gpiPinFromKeyCode(rawKeyCode));
+      }
+
+      if (!changed) {
+        pendingEvents[kept++] = pendingEvents[i];
+      }
+    }
+    pendingEventsCount = kept;
+  }
+}
+
+void TCA8418::clearKeyState(uint8_t arrayIndex) {
+  clearBit(keysPushed, arrayIndex);
+  clearBit(keysReleased, arrayIndex);
+  clearBit(keysStillPushed, arrayIndex);
+}
+
 TCA8418::Error TCA8418::configureKeypad(const TCA8418::Config::Keypad_ *config) {
-  uint8_t kpGpio1Reg = 0;
-  uint8_t kpGpio2Reg = 0;
-  uint8_t kpGpio3Reg = 0;
+  uint8_t kpGpioRegs[3] = {0, 0, 0};
 
+  // Row and column enums share the pin numbering, which is also the bit position across the
+  // KP_GPIO1-3 register triple.
   for (uint8_t i = 0; i < config->RowsCount; ++i) {
-    uint8_t row = static_cast<uint8_t>(config->Rows[i]);
-    kpGpio1Reg |= (1 << row);
+    setBit(kpGpioRegs, static_cast<uint8_t>(config->Rows[i]));
   }
 
   for (uint8_t i = 0; i < config->ColsCount; ++i) {
-    uint8_t col = static_cast<uint8_t>(config->Cols[i]);
-    if (col < 8) {
-      kpGpio2Reg |= (1 << col);
-    } else if (col == 8) {
-      kpGpio3Reg |= (1 << 0);
-    } else if (col == 9) {
-      kpGpio3Reg |= (1 << 1);
-    }
+    setBit(kpGpioRegs, static_cast<uint8_t>(config->Cols[i]));
   }
 
   // Set these rows / cols as keypad scanned; enable interrupts
-  TRY_ERR(writeRegister(register_t::KP_GPIO1, kpGpio1Reg));
-  TRY_ERR(writeRegister(register_t::KP_GPIO2, kpGpio2Reg));
-  TRY_ERR(writeRegister(register_t::KP_GPIO3, kpGpio3Reg));
+  TRY_ERR(writeRegister(register_t::KP_GPIO1, kpGpioRegs[0]));
+  TRY_ERR(writeRegister(register_t::KP_GPIO2, kpGpioRegs[1]));
+  TRY_ERR(writeRegister(register_t::KP_GPIO3, kpGpioRegs[2]));
   TRY_ERR(modifyRegister(register_t::CFG, 1, 0x01));
 
   return NO_ERROR;
@@ -99,6 +252,13 @@ TCA8418::Error TCA8418::configureGpioInputs(const TCA8418::Config::GpioIn_ *conf
     TRY_ERR(modifyRegister(register_t::GPIO_PULL3, 0xFF, reg_data_mask[2]));
   }
 
+  // Debounce is enabled at reset (DEBOUNCE_DIS1–3), write 1s here to disable it
+  if (!config->EnableDebounce) {
+    TRY_ERR(modifyRegister(register_t::DEBOUNCE_DIS1, 0xFF, reg_data_mask[0]));
+    TRY_ERR(modifyRegister(register_t::DEBOUNCE_DIS2, 0xFF, reg_data_mask[1]));
+    TRY_ERR(modifyRegister(register_t::DEBOUNCE_DIS3, 0xFF, reg_data_mask[2]));
+  }
+
   // Enable GPIO Interrupts
   TRY_ERR(modifyRegister(register_t::CFG, 1, 0x02));
 
@@ -109,14 +269,93 @@ void TCA8418::createRegisterTripleMask(pin_t *pins, uint8_t pins_count,
                                        uint8_t register_triple[3]) {
   for (uint8_t i = 0; i < pins_count; ++i) {
     uint8_t pin = static_cast<uint8_t>(pins[i]);
-    if (pin < 8) {
-      register_triple[0] |= (1 << pin);
-    } else if (pin < 16) {
-      register_triple[1] |= (1 << pin);
-    } else if (pin < 18) {
-      register_triple[2] |= (1 << pin);
+    if (pin < PIN_COUNT) {
+      setBit(register_triple, pin);
+    }
+  }
+}
+
+uint8_t TCA8418::configuredKeyCount() const {
+  uint8_t rows = countBitsBelow(layout_.Keypad, KEYPAD_ROWS);
+  uint8_t cols = countBitsBelow(layout_.Keypad, PIN_COUNT) - rows;
+  return rows * cols + countBitsBelow(layout_.Gpio, PIN_COUNT);
+}
+
+TCA8418::Error TCA8418::attachUsageTelemetry(KeyUsageTelemetry *telemetry) {
+  usage_ = telemetry;
+  if (usage_ == nullptr) return NO_ERROR;
+  return bindUsageTelemetry();
+}
+
+TCA8418::Error TCA8418::bindUsageTelemetry() {
+  // Slot order is ascending key code order: keypad keys row by row, then GPIs. The slot map
+  // turns a key code into its slot on the event path without scanning the layout.
+  uint8_t keyCodes[KEYPAD_ROWS * KEYPAD_COLS + PIN_COUNT];
+  uint8_t count = 0;
+  KeyUsageTelemetry::SlotMap slots;
+
+  uint8_t cols = 0;
+  for (uint8_t col = 0; col < KEYPAD_COLS; ++col) {
+    bool configured = readBit(layout_.Keypad, KEYPAD_ROWS + col);
+    slots.ColRank[col] = configured ? cols++ : KeyUsageTelemetry::NO_SLOT;
+  }
+
+  for (uint8_t row = 0; row < KEYPAD_ROWS; ++row) {
+    if (!readBit(layout_.Keypad, row)) {
+      slots.RowBase[row] = KeyUsageTelemetry::NO_SLOT;
+      continue;
+    }
+    slots.RowBase[row] = count;
+    for (uint8_t col = 0; col < KEYPAD_COLS; ++col) {
+      if (slots.ColRank[col] != KeyUsageTelemetry::NO_SLOT) {
+        keyCodes[count++] = row * KEYPAD_COLS + col + 1;
+      }
     }
   }
+
+  for (uint8_t pin = 0; pin < PIN_COUNT; ++pin) {
+    if (readBit(layout_.Gpio, pin)) {
+      slots.GpioSlot[pin] = count;
+      keyCodes[count++] = GPIO_KEYCODE_BASE + pin;
+    } else {
+      slots.GpioSlot[pin] = KeyUsageTelemetry::NO_SLOT;
+    }
+  }
+
+  if (!usage_->bind(keyCodes, count, &slots)) {
+    // Slots would no longer match the table; stop feeding it
+    usage_ = nullptr;
+    return TELEMETRY_TABLE_TOO_SMALL;
+  }
+
+  return NO_ERROR;
+}
+
+uint8_t TCA8418::usageSlot(uint8_t rawKeyCode, keycode_type_t type) const {
+  const KeyUsageTelemetry::SlotMap *slots = usage_->slotMap();
+
+  if (type == keycode_type_t::KEYPAD) {
+    uint8_t row, col;
+    splitKeypadKeyCode(rawKeyCode, &row, &col);
+    uint8_t rowBase = slots->RowBase[row];
+    uint8_t colRank = slots->ColRank[col];
+    if (rowBase == KeyUsageTelemetry::NO_SLOT || colRank == KeyUsageTelemetry::NO_SLOT) {
+      return KeyUsageTelemetry::NO_SLOT;
+    }
+    return rowBase + colRank;
+  } else if (type == keycode_type_t::GPIO) {
+    return slots->GpioSlot[gpiPinFromKeyCode(rawKeyCode)];
+  }
+
+  return KeyUsageTelemetry::NO_SLOT;
+}
+
+uint8_t TCA8418::countBitsBelow(const uint8_t *bytes, uint8_t bitNumber) const {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < bitNumber; ++i) {
+    if (readBit(bytes, i)) ++count;
+  }
+  return count;
 }
 
 bool TCA8418::wasKeyPressed(uint8_t keyCode) const {
@@ -165,29 +404,93 @@ TCA8418::Error TCA8418::readRegister(register_t register_address, uint8_t *out_d
 }
 
 TCA8418::Error TCA8418::handleInterrupt() {
-  const uint8_t K_INT_BIT = 0;
-  const uint8_t GPI_INT_BIT = 1;
+  // Cleared before draining, so an INT arriving meanwhile is not lost
+  interruptPending_ = false;
+
+  // K_INT and GPI_INT are the only sources we act on, and both mean the FIFO has events. Draining
+  // stops at the first empty read, so INT_STAT does not need to be read first; that saves a bus
+  // transaction on every wake.
+  // Ignore possible error; Continue to clear interrupt regardless.
+  readKeyEventsFifo();
+
+  // Nothing for updateButtonStates() to deliver, so this wake has no latency to measure
+  if (pendingEventsCount == 0) {
+    awaitingWakeEvent_ = false;
+  }
 
-  // Read INT_STAT to find out what triggered the interrupt
-  uint8_t intStatReg = 0;
-  TRY_ERR(readRegister(register_t::INT_STAT, &intStatReg));
+  // Acknowledge interrupt and clear flags
+  Error error = writeRegister(register_t::INT_STAT, 0xFF);
 
-  // Support K_INT and GPIP_INT for now, TODO support all interrupts?
-  if (intStatReg & _BV(K_INT_BIT) || intStatReg & _BV(GPI_INT_BIT)) {
-    // Ignore possible error; Continue to clear interrupt regardless.
-    readKeyEventsFifo();
+  // INT is released now, so a level-triggered source masked by the ISR can be unmasked. Done even
+  // if the write failed: INT then stays low, the ISR fires once more and the retry is scheduled.
+  if (interruptRearmCallback_) {
+    interruptRearmCallback_();
   }
 
-  // Acknowledge interrupt and clear flags
-  TRY_ERR(writeRegister(register_t::INT_STAT, 0xFF));
+  return error;
+}
 
-  return NO_ERROR;
+void TCA8418::notifyInterrupt() {
+  if (wakeTicks_ && !awaitingWakeEvent_) {
+    wakeAt_ = wakeTicks_();
+    awaitingWakeEvent_ = true;
+  }
+  interruptPending_ = true;
+}
+
+bool TCA8418::isInterruptPending() const {
+  return interruptPending_;
+}
+
+bool TCA8418::isIdle() const {
+  if (interruptPending_ || pendingEventsCount != 0) return false;
+
+  // A quiet period only ends when updateButtonStates() sees it has passed, even if the pin is back
+  // at its reported level; sleeping through it would leave edges after the wake filtered out
+  for (uint8_t i = 0; i < gpiFiltersCount_; ++i) {
+    if (gpiFilters_[i].State & FILTER_LOCKED) return false;
+  }
+
+  return true;
+}
+
+void TCA8418::setInterruptRearmCallback(InterruptRearmCallback cb) {
+  interruptRearmCallback_ = cb;
+}
+
+void TCA8418::setWakeLatencyTickSource(TickSource ticks) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    wakeTicks_ = ticks;
+    awaitingWakeEvent_ = false;
+    lastWakeLatency_ = 0;
+    maxWakeLatency_ = 0;
+  }
+}
+
+uint16_t TCA8418::lastWakeLatency() const {
+  return lastWakeLatency_;
+}
+
+uint16_t TCA8418::maxWakeLatency() const {
+  return maxWakeLatency_;
 }
 
 void TCA8418::updateButtonStates() {
+  releaseSettledGpiFilters();
+
   memset(keysPushed, 0, sizeof(keysPushed));
   memset(keysReleased, 0, sizeof(keysReleased));
 
+  if (awaitingWakeEvent_ && pendingEventsCount != 0) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      lastWakeLatency_ = wakeTicks_() - wakeAt_;
+      awaitingWakeEvent_ = false;
+    }
+    if (lastWakeLatency_ > maxWakeLatency_) {
+      maxWakeLatency_ = lastWakeLatency_;
+    }
+  }
+
   for (uint8_t i = 0; i < pendingEventsCount; ++i) {
     updateButtonState(pendingEvents[i]);
   }
@@ -214,15 +517,24 @@ void TCA8418::clearBit(uint8_t *bytes, uint8_t bitNumber) const {
 }
 
 TCA8418::keycode_type_t TCA8418::classifyKeycode(uint8_t keyCode) const {
-  if (keyCode >= 1 && keyCode <= 80) {
+  if (keyCode >= 1 && keyCode <= KEYPAD_ROWS * KEYPAD_COLS) {
     return keycode_type_t::KEYPAD;
-  } else if (keyCode >= 97 && keyCode <= 114) {
+  } else if (keyCode >= GPIO_KEYCODE_BASE && keyCode < GPIO_KEYCODE_BASE + PIN_COUNT) {
     return keycode_type_t::GPIO;
   } else {
     return keycode_type_t::UNKNOWN;
   }
 }
 
+void TCA8418::splitKeypadKeyCode(uint8_t rawKeyCode, uint8_t *out_row, uint8_t *out_col) const {
+  *out_row = (rawKeyCode - 1) / KEYPAD_COLS;
+  *out_col = (rawKeyCode - 1) % KEYPAD_COLS;
+}
+
+uint8_t TCA8418::gpiPinFromKeyCode(uint8_t rawKeyCode) const {
+  return rawKeyCode - GPIO_KEYCODE_BASE;
+}
+
 TCA8418::keycode_type_t TCA8418::mapKeyCodeToArray(uint8_t rawKeyCode,
                                                    uint8_t *outCorrectedCode) const {
   auto type = classifyKeycode(rawKeyCode);
@@ -246,21 +558,167 @@ TCA8418::keycode_type_t TCA8418::mapKeyCodeToArray(uint8_t rawKeyCode,
 }
 
 uint8_t TCA8418::readKeyEventsFifo() {
-  uint8_t keyLockReg = 0;
-  TRY_ERR(readRegister(register_t::KEY_LCK_EC, &keyLockReg));
-  uint8_t eventsCount = keyLockReg & 0x0F;
+  // Events still arriving while draining are picked up too; bound the loop so a chattering input
+  // cannot keep us here forever.
+  const uint8_t MAX_EVENTS_PER_DRAIN = 32;
+
+  // KEY_EVENT_A reads 0 once the FIFO is empty, so there is no need to read KEY_LCK_EC first
+  for (uint8_t i = 0; i < MAX_EVENTS_PER_DRAIN; ++i) {
+    // Leave events in the device FIFO rather than read them with nowhere to queue them
+    if (pendingEventsCount >= sizeof(pendingEvents)) break;
 
-  for (uint8_t i = 0; i < eventsCount; ++i) {
     uint8_t keyEventReg = 0;
     TRY_ERR(readRegister(register_t::KEY_EVENT_A, &keyEventReg));
-    pendingEvents[i] = keyEventReg;
+    if (keyEventReg == 0) return NO_ERROR;
+
+    if (filterGpiEvent(keyEventReg)) continue;
+    if (decodeEncoderEvent(keyEventReg)) continue;
+
+    // Append, so events not yet consumed by updateButtonStates() are kept
+    pendingEvents[pendingEventsCount++] = keyEventReg;
   }
 
-  pendingEventsCount = eventsCount;
+  // The FIFO may still hold events and INT_STAT is about to be cleared, so no new INT is
+  // guaranteed; keep handleInterrupt() due until a drain finds the FIFO empty.
+  interruptPending_ = true;
 
   return NO_ERROR;
 }
 
+bool TCA8418::filterGpiEvent(uint8_t event) {
+  uint8_t rawKeyCode = event & 0b0111'1111;
+  if (gpiFiltersCount_ == 0 || classifyKeycode(rawKeyCode) != keycode_type_t::GPIO) return false;
+
+  uint8_t pin = gpiPinFromKeyCode(rawKeyCode);
+  bool active = event & 0b1000'0000;
+
+  for (uint8_t i = 0; i < gpiFiltersCount_; ++i) {
+    GpiFilter *filter = &gpiFilters_[i];
+    if (pin != static_cast<uint8_t>(filter->Pin)) continue;
+
+    uint16_t now = gpiFilterTicks_();
+    if (active) {
+      filter->State |= FILTER_RAW_ACTIVE;
+    } else {
+      filter->State &= ~FILTER_RAW_ACTIVE;
+    }
+
+    // Still bouncing: every edge restarts the quiet period, and the settled level is reported by
+    // updateButtonStates() once it has passed
+    if ((filter->State & FILTER_LOCKED) &&
+        static_cast<uint16_t>(now - filter->LastEdgeAt) < filter->Ticks) {
+      filter->LastEdgeAt = now;
+      return true;
+    }
+
+    filter->State &= ~FILTER_LOCKED;
+    if (active == static_cast<bool>(filter->State & FILTER_ACCEPTED_ACTIVE)) return true;
+
+    filter->State ^= FILTER_ACCEPTED_ACTIVE;
+    filter->State |= FILTER_LOCKED;
+    filter->LastEdgeAt = now;
+    return false;
+  }
+
+  return false;
+}
+
+void TCA8418::releaseSettledGpiFilters() {
+  for (uint8_t i = 0; i < gpiFiltersCount_; ++i) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      releaseSettledGpiFilter(&gpiFilters_[i]);
+    }
+  }
+}
+
+void TCA8418::releaseSettledGpiFilter(GpiFilter *filter) {
+  uint16_t now = gpiFilterTicks_();
+  if (!(filter->State & FILTER_LOCKED) ||
+      static_cast<uint16_t>(now - filter->LastEdgeAt) < filter->Ticks) {
+    return;
+  }
+
+  bool raw = filter->State & FILTER_RAW_ACTIVE;
+  bool accepted = filter->State & FILTER_ACCEPTED_ACTIVE;
+  if (raw == accepted) {
+    filter->State &= ~FILTER_LOCKED;
+    return;
+  }
+
+  // Report the settled level the same way as a FIFO event, so encoder pins are decoded rather
+  // than queued. Stay locked and retry on the next update if there is no room.
+  uint8_t keyCode = GPIO_KEYCODE_BASE + static_cast<uint8_t>(filter->Pin);
+  uint8_t event = (raw ? 0b1000'0000 : 0) | keyCode;
+  if (!decodeEncoderEvent(event)) {
+    if (pendingEventsCount >= sizeof(pendingEvents)) return;
+    pendingEvents[pendingEventsCount++] = event;
+  }
+
+  // Start a new lockout from the reported level
+  filter->State ^= FILTER_ACCEPTED_ACTIVE;
+  filter->LastEdgeAt = now;
+}
+
+bool TCA8418::decodeEncoderEvent(uint8_t event) {
+  // Indexed by (previous AB state << 2) | new AB state; A leading B counts up
+  static const int8_t QUADRATURE_STEPS[16] = {
+      0, -1, 1, 0, 1, 0, 0, -1, -1, 0, 0, 1, 0, 1, -1, 0,
+  };
+
+  uint8_t rawKeyCode = event & 0b0111'1111;
+  if (encodersCount_ == 0 || classifyKeycode(rawKeyCode) != keycode_type_t::GPIO) return false;
+
+  uint8_t pin = gpiPinFromKeyCode(rawKeyCode);
+  bool active = event & 0b1000'0000;
+
+  for (uint8_t i = 0; i < encodersCount_; ++i) {
+    Encoder *encoder = &encoders_[i];
+
+    uint8_t bit = 0;
+    if (pin == static_cast<uint8_t>(encoder->PinA)) {
+      bit = 0b10;
+    } else if (pin == static_cast<uint8_t>(encoder->PinB)) {
+      bit = 0b01;
+    } else {
+      continue;
+    }
+
+    // Encoder events never reach keysStillPushed, so keep the pin level here for reseeding
+    if (active) {
+      setBit(encoderLevels_, pin);
+    } else {
+      clearBit(encoderLevels_, pin);
+    }
+
+    uint8_t newState = active ? (encoder->State | bit) : (encoder->State & ~bit);
+    int8_t step = QUADRATURE_STEPS[(encoder->State << 2) | newState];
+    encoder->State = newState;
+    if (step == 0) return true;
+
+    encoder->Count += step;
+
+    if (encoderTicks_) {
+      // Events drained together share a timestamp; the smoothing evens that out
+      uint16_t now = encoderTicks_();
+      if (encoder->Direction == step) {
+        uint16_t interval = now - encoder->LastStepAt;
+        if (interval == 0) interval = 1;
+        encoder->StepTicks =
+            encoder->StepTicks ? (3 * static_cast<uint32_t>(encoder->StepTicks) + interval) / 4
+                               : interval;
+      } else {
+        encoder->StepTicks = 0;
+      }
+      encoder->LastStepAt = now;
+      encoder->Direction = step;
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
 void TCA8418::updateButtonState(uint8_t pendingEvent) {
   uint8_t rawKeyCode = pendingEvent & 0b0111'1111;
   key_event_type_t eventType = static_cast<key_event_type_t>((pendingEvent & 0b1000'0000) >> 7);
@@ -272,6 +730,9 @@ void TCA8418::updateButtonState(uint8_t pendingEvent) {
   if (eventType == key_event_type_t::PRESSED) {
     setBit(keysPushed, arrayIndex);
     setBit(keysStillPushed, arrayIndex);
+    if (usage_) {
+      usage_->recordPress(usageSlot(rawKeyCode, type));
+    }
     if (keyPressCallback_) {
       keyPressCallback_(rawKeyCode);
     }
@@ -279,6 +740,9 @@ void TCA8418::updateButtonState(uint8_t pendingEvent) {
     clearBit(keysPushed, arrayIndex);
     clearBit(keysStillPushed, arrayIndex);
     setBit(keysReleased, arrayIndex);
+    if (usage_) {
+      usage_->recordRelease(usageSlot(rawKeyCode, type));
+    }
     if (keyReleaseCallback_) {
       keyReleaseCallback_(rawKeyCode);
     }
@@ -286,6 +750,162 @@ void TCA8418::updateButtonState(uint8_t pendingEvent) {
     // Can never happen
   }
 }
+TCA8418::Error TCA8418::setEncoders(Encoder *encoders, uint8_t count, TickSource ticks) {
+  // Start from the pins' current levels; nothing changes if they cannot be read
+  uint8_t activePins[3] = {0, 0, 0};
+  if (count > 0) {
+    TRY_ERR(readActivePins(&layout_, activePins));
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    for (uint8_t i = 0; i < count; ++i) {
+      Encoder *encoder = &encoders[i];
+      encoder->Count = 0;
+      encoder->StepTicks = 0;
+      encoder->LastStepAt = 0;
+      encoder->Direction = 0;
+      encoder->State = (readBit(activePins, static_cast<uint8_t>(encoder->PinA)) ? 0b10 : 0) |
+                       (readBit(activePins, static_cast<uint8_t>(encoder->PinB)) ? 0b01 : 0);
+    }
+
+    memset(encoderPins_, 0, sizeof(encoderPins_));
+    for (uint8_t i = 0; i < count; ++i) {
+      setBit(encoderPins_, static_cast<uint8_t>(encoders[i].PinA));
+      setBit(encoderPins_, static_cast<uint8_t>(encoders[i].PinB));
+    }
+    memcpy(encoderLevels_, activePins, sizeof(encoderLevels_));
+
+    encoders_ = encoders;
+    encodersCount_ = count;
+    encoderTicks_ = ticks;
+  }
+
+  return NO_ERROR;
+}
+
+bool TCA8418::lastGpiLevel(uint8_t pin) const {
+  if (readBit(encoderPins_, pin)) return readBit(encoderLevels_, pin);
+  return readBit(keysStillPushed, GPIO_ARRAY_OFFSET + pin);
+}
+
+void TCA8418::resetChangedGpiInputs(const uint8_t changed_pins[3], const uint8_t active_pins[3]) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    // Encoders on pins that changed role continue from the pins' current levels
+    for (uint8_t i = 0; i < 3; ++i) {
+      encoderLevels_[i] &= ~changed_pins[i];
+      encoderLevels_[i] |= active_pins[i] & changed_pins[i];
+    }
+
+    for (uint8_t i = 0; i < encodersCount_; ++i) {
+      Encoder *encoder = &encoders_[i];
+      uint8_t pinA = static_cast<uint8_t>(encoder->PinA);
+      uint8_t pinB = static_cast<uint8_t>(encoder->PinB);
+      if (!readBit(changed_pins, pinA) && !readBit(changed_pins, pinB)) continue;
+      if (readBit(changed_pins, pinA)) {
+        encoder->State = (encoder->State & ~0b10) | (readBit(active_pins, pinA) ? 0b10 : 0);
+      }
+      if (readBit(changed_pins, pinB)) {
+        encoder->State = (encoder->State & ~0b01) | (readBit(active_pins, pinB) ? 0b01 : 0);
+      }
+      encoder->StepTicks = 0;
+      encoder->Direction = 0;
+    }
+
+    // Their key state was cleared, so a filter whose pin is active reports it after a quiet period
+    for (uint8_t i = 0; i < gpiFiltersCount_; ++i) {
+      GpiFilter *filter = &gpiFilters_[i];
+      uint8_t pin = static_cast<uint8_t>(filter->Pin);
+      if (readBit(changed_pins, pin)) {
+        seedGpiFilter(filter, readBit(active_pins, pin), gpiFilterTicks_());
+      }
+    }
+  }
+}
+
+TCA8418::Error TCA8418::readActivePins(const Layout *layout, uint8_t out_active[3]) {
+  // GPIO_DAT_STAT holds the pin levels; a GPI is active at the level its GPIO_INT_LVL bit selects,
+  // the same level that makes the device report it pressed. Pins that are not GPIs never are.
+  TRY_ERR(readRegister(register_t::GPIO_DAT_STAT1, &out_active[0]));
+  TRY_ERR(readRegister(register_t::GPIO_DAT_STAT2, &out_active[1]));
+  TRY_ERR(readRegister(register_t::GPIO_DAT_STAT3, &out_active[2]));
+
+  for (uint8_t i = 0; i < 3; ++i) {
+    out_active[i] = ~(out_active[i] ^ layout->RisingEdge[i]) & layout->Gpio[i];
+  }
+
+  return NO_ERROR;
+}
+
+void TCA8418::seedGpiFilter(GpiFilter *filter, bool active, uint16_t now) {
+  // The accepted level is the one last reported. A pin found elsewhere starts in a quiet period,
+  // after which updateButtonStates() reports it like any other settled level.
+  bool accepted = lastGpiLevel(static_cast<uint8_t>(filter->Pin));
+  filter->State = (accepted ? FILTER_ACCEPTED_ACTIVE : 0) | (active ? FILTER_RAW_ACTIVE : 0);
+  if (active != accepted) {
+    filter->State |= FILTER_LOCKED;
+  }
+  filter->LastEdgeAt = now;
+}
+
+TCA8418::Error TCA8418::setGpiFilters(GpiFilter *filters, uint8_t count, TickSource ticks) {
+  if (ticks == nullptr) count = 0;
+
+  // Start from the pins' current levels; nothing changes if they cannot be read
+  uint8_t activePins[3] = {0, 0, 0};
+  if (count > 0) {
+    TRY_ERR(readActivePins(&layout_, activePins));
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uint16_t now = (count > 0) ? ticks() : 0;
+    for (uint8_t i = 0; i < count; ++i) {
+      GpiFilter *filter = &filters[i];
+      seedGpiFilter(filter, readBit(activePins, static_cast<uint8_t>(filter->Pin)), now);
+    }
+
+    gpiFilters_ = filters;
+    gpiFiltersCount_ = count;
+    gpiFilterTicks_ = ticks;
+  }
+
+  return NO_ERROR;
+}
+
+int16_t TCA8418::takeEncoderCount(uint8_t index) {
+  if (index >= encodersCount_) return 0;
+
+  int16_t count = 0;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    count = encoders_[index].Count;
+    encoders_[index].Count = 0;
+  }
+  return count;
+}
+
+int16_t TCA8418::encoderVelocity(uint8_t index, uint16_t ticksPerSecond) const {
+  if (index >= encodersCount_ || encoderTicks_ == nullptr) return 0;
+
+  uint16_t stepTicks = 0;
+  uint16_t lastStepAt = 0;
+  int8_t direction = 0;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    stepTicks = encoders_[index].StepTicks;
+    lastStepAt = encoders_[index].LastStepAt;
+    direction = encoders_[index].Direction;
+  }
+  if (stepTicks == 0) return 0;
+
+  // Once no transition has arrived for longer than the last interval, use the time since the last
+  // one instead, so the estimate falls off when the encoder stops.
+  uint16_t sinceLastStep = encoderTicks_() - lastStepAt;
+  uint16_t interval = sinceLastStep > stepTicks ? sinceLastStep : stepTicks;
+  // A fast spin on a fast timer can exceed int16_t; saturate rather than wrap
+  const uint16_t MAX_SPEED = 0x7FFF;
+  uint16_t speed = ticksPerSecond / interval;
+  if (speed > MAX_SPEED) speed = MAX_SPEED;
+  return direction * static_cast<int16_t>(speed);
+}
+
 void TCA8418::setKeyPressedCallback(KeyCodeCallback cb) {
   keyPressCallback_ = cb;
 }
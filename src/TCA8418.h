@@ -3,10 +3,14 @@
 
 #include <stdint.h>
 
+#include "KeyUsageTelemetry.h"
+
 class TCA8418 {
  public:
   typedef uint8_t Error;
   static const Error NO_ERROR = 0;
+  // I2C errors are TWI status codes (multiples of 8); driver errors use the low bits.
+  static const Error TELEMETRY_TABLE_TOO_SMALL = 0x01;
 
   enum class row_t : uint8_t {
     ROW0 = 0,
@@ -68,18 +72,91 @@ class TCA8418 {
       TCA8418::pin_t* Pins = nullptr;
       uint8_t PinsCount = 0;
     } GpioInput;
+
+    // INT_CFG: pulse INT high for 50 μs and reassert while interrupts are still pending (suits
+    // edge-triggered inputs). When false, INT stays low until INT_STAT is cleared, which suits
+    // waking from power-down on a low level.
+    bool InterruptReassert = true;
+  };
+
+  // Quadrature encoder on two GPI pins. Fields below the pins are maintained by the driver.
+  struct Encoder {
+    TCA8418::pin_t PinA;
+    TCA8418::pin_t PinB;
+    // Signed count of quadrature transitions (typically 4 per detent)
+    int16_t Count;
+    // Smoothed ticks between transitions in the current direction, 0 until known
+    uint16_t StepTicks;
+    uint16_t LastStepAt;
+    int8_t Direction;
+    uint8_t State;
+  };
+
+  // Software debounce for one GPI pin. Fields below Ticks are maintained by the driver.
+  struct GpiFilter {
+    TCA8418::pin_t Pin;
+    // Quiet time: after an accepted edge, edges are bounce until none has arrived for this long
+    uint16_t Ticks;
+    uint16_t LastEdgeAt;
+    uint8_t State;
   };
 
   typedef void (*KeyCodeCallback)(uint8_t);
+  typedef void (*InterruptRearmCallback)();
+  typedef uint16_t (*TickSource)();
 
   Error begin(const Config* c);
+  // Switch to a new keypad / GPI layout without resetting the device. Only registers whose bits
+  // differ from the current layout are written, and only pins that changed role lose their
+  // pressed / released / held state.
+  Error apply(const Config* c);
   void updateButtonStates();
   bool wasKeyPressed(uint8_t keyCode) const;
   bool wasKeyReleased(uint8_t keyCode) const;
   bool isKeyHeld(uint8_t keyCode) const;
   Error handleInterrupt();
+  // Call from the INT pin's ISR. Marks work as pending and timestamps the wake for the latency
+  // metric; handleInterrupt() still has to run outside the ISR or right after it. With a
+  // level-triggered INT, mask the external interrupt in the ISR too, or it fires continuously
+  // until INT_STAT is cleared; unmask it from the re-arm callback.
+  void notifyInterrupt();
+  // Called at the end of handleInterrupt(), once INT_STAT has been cleared
+  void setInterruptRearmCallback(InterruptRearmCallback cb);
+  // Also true when the last drain stopped with events left in the device FIFO, because the event
+  // buffer was full or the per-drain limit was hit. Call handleInterrupt() again after
+  // updateButtonStates().
+  bool isInterruptPending() const;
+  // True when there is nothing left for the driver to do until the next INT: no interrupt waiting
+  // to be handled, no events waiting for updateButtonStates() and no GPI filter in its quiet
+  // period. Check with interrupts disabled right before sleeping.
+  bool isIdle() const;
+  // Ticks from notifyInterrupt() to the first key event delivered by updateButtonStates(). The
+  // tick source only runs while awake, so a fast free-running timer works well.
+  void setWakeLatencyTickSource(TickSource ticks);
+  uint16_t lastWakeLatency() const;
+  uint16_t maxWakeLatency() const;
   void setKeyPressedCallback(KeyCodeCallback cb);
   void setKeyReleasedCallback(KeyCodeCallback cb);
+  // Number of keypad keys plus GPI pins in the active layout
+  uint8_t configuredKeyCount() const;
+  // Feed press / release events of the configured keys to telemetry (nullptr detaches). Call
+  // after begin(); apply() rebinds it when the key set changes.
+  Error attachUsageTelemetry(KeyUsageTelemetry* telemetry);
+  // Decode GPI events of the encoder pins while draining the FIFO. Those events no longer reach
+  // the key state bitmaps or callbacks. Pass a tick source to estimate velocity. The phase starts
+  // from the pin levels read from the device, and apply() reseeds it the same way for pins that
+  // changed role; pins that are no longer GPIs simply stop producing events.
+  Error setEncoders(Encoder* encoders, uint8_t count, TickSource ticks = nullptr);
+  // Filter GPI events before they reach the key state bitmaps and callbacks. The first edge is
+  // reported at once and starts a quiet period of the filter's Ticks; each further edge restarts
+  // it. Once the pin has been quiet that long, updateButtonStates() reports the settled level if
+  // it differs from the last one reported. A pin whose level read from the device differs from
+  // the last one reported, here or after apply() changes its role, starts in a quiet period.
+  Error setGpiFilters(GpiFilter* filters, uint8_t count, TickSource ticks);
+  // Transitions counted since the previous call for this encoder
+  int16_t takeEncoderCount(uint8_t index);
+  // Signed transitions per second, decaying towards 0 once the encoder stops
+  int16_t encoderVelocity(uint8_t index, uint16_t ticksPerSecond) const;
 
  private:
   enum class register_t : uint8_t {
@@ -87,6 +164,9 @@ class TCA8418 {
     INT_STAT = 0x02,
     KEY_LCK_EC = 0x03,
     KEY_EVENT_A = 0x04,
+    GPIO_DAT_STAT1 = 0x14,
+    GPIO_DAT_STAT2 = 0x15,
+    GPIO_DAT_STAT3 = 0x16,
     KP_GPIO1 = 0x1D,
     KP_GPIO2 = 0x1E,
     KP_GPIO3 = 0x1F,
@@ -102,11 +182,38 @@ class TCA8418 {
     GPIO_INT_LVL1 = 0x26,
     GPIO_INT_LVL2 = 0x27,
     GPIO_INT_LVL3 = 0x28,
+    DEBOUNCE_DIS1 = 0x29,
+    DEBOUNCE_DIS2 = 0x2A,
+    DEBOUNCE_DIS3 = 0x2B,
     GPIO_PULL1 = 0x2C,
     GPIO_PULL2 = 0x2D,
     GPIO_PULL3 = 0x2E,
   };
 
+  // Pins are numbered ROW0-7 = 0-7, COL0-9 = 8-17, matching bit positions across a register
+  // triple; any of them can be a GPI. Keypad key codes are row * 10 + col + 1, GPI key codes
+  // start at 97, and the key state bitmaps hold the GPIs after the 80 keypad keys.
+  static const uint8_t KEYPAD_ROWS = 8;
+  static const uint8_t KEYPAD_COLS = 10;
+  static const uint8_t PIN_COUNT = 18;
+  static const uint8_t GPIO_KEYCODE_BASE = 97;
+  static const uint8_t GPIO_ARRAY_OFFSET = 80;
+
+  // Per-pin bitmaps of the active configuration, in register triple order
+  // (ROW0-7, COL0-7, COL8-9) so each byte lines up with the xxx1-3 registers.
+  struct Layout {
+    uint8_t Keypad[3];
+    uint8_t Gpio[3];
+    uint8_t RisingEdge[3];
+    uint8_t PullupDisabled[3];
+    uint8_t DebounceDisabled[3];
+  };
+
+  // GpiFilter::State bits
+  static const uint8_t FILTER_ACCEPTED_ACTIVE = 0x01;
+  static const uint8_t FILTER_RAW_ACTIVE = 0x02;
+  static const uint8_t FILTER_LOCKED = 0x04;
+
   enum class key_event_type_t : uint8_t {
     RELEASED = 0,
     PRESSED = 1,
@@ -121,15 +228,34 @@ class TCA8418 {
   Error configureKeypad(const TCA8418::Config::Keypad_* config);
   Error configureGpioInputs(const TCA8418::Config::GpioIn_* config);
   void createRegisterTripleMask(pin_t* pins, uint8_t pins_count, uint8_t register_triple[3]);
+  void createLayout(const Config* c, Layout* out_layout);
+  Error applyRegisterTriple(register_t first_register, const uint8_t data[3],
+                            const uint8_t mask[3]);
+  void clearChangedKeyStates(const uint8_t changed_pins[3]);
+  void clearKeyState(uint8_t arrayIndex);
+  void dropChangedPendingEvents(const uint8_t changed_pins[3]);
+  void resetChangedGpiInputs(const uint8_t changed_pins[3], const uint8_t active_pins[3]);
+  bool lastGpiLevel(uint8_t pin) const;
+  Error readActivePins(const Layout* layout, uint8_t out_active[3]);
+  void seedGpiFilter(GpiFilter* filter, bool active, uint16_t now);
+  Error bindUsageTelemetry();
+  uint8_t usageSlot(uint8_t rawKeyCode, keycode_type_t type) const;
+  uint8_t countBitsBelow(const uint8_t* bytes, uint8_t bitNumber) const;
   Error writeRegister(register_t register_address, uint8_t data);
   Error modifyRegister(register_t register_address, uint8_t data, uint8_t mask);
   Error readRegister(register_t register_address, uint8_t* out_data);
   Error readKeyEventsFifo();
   void updateButtonState(uint8_t pendingEvent);
+  bool decodeEncoderEvent(uint8_t event);
+  bool filterGpiEvent(uint8_t event);
+  void releaseSettledGpiFilters();
+  void releaseSettledGpiFilter(GpiFilter* filter);
   uint8_t readBit(const uint8_t* bytes, uint8_t bitNumber) const;
   void setBit(uint8_t* bytes, uint8_t bitNumber) const;
   void clearBit(uint8_t* bytes, uint8_t bitNumber) const;
   keycode_type_t classifyKeycode(uint8_t keyCode) const;
+  void splitKeypadKeyCode(uint8_t rawKeyCode, uint8_t* out_row, uint8_t* out_col) const;
+  uint8_t gpiPinFromKeyCode(uint8_t rawKeyCode) const;
   keycode_type_t mapKeyCodeToArray(uint8_t rawKeyCode, uint8_t* outCorrectedCode) const;
   bool readKeyBit(const uint8_t* bytes, uint8_t rawKeyCode) const;
 
@@ -139,8 +265,26 @@ class TCA8418 {
   uint8_t keysStillPushed[12];
   uint8_t pendingEvents[10];
   uint8_t pendingEventsCount = 0;
+  Layout layout_{};
   KeyCodeCallback keyPressCallback_{nullptr};
   KeyCodeCallback keyReleaseCallback_{nullptr};
+  KeyUsageTelemetry* usage_{nullptr};
+  Encoder* encoders_{nullptr};
+  uint8_t encodersCount_ = 0;
+  TickSource encoderTicks_{nullptr};
+  uint8_t encoderPins_[3] = {0, 0, 0};
+  uint8_t encoderLevels_[3] = {0, 0, 0};
+  GpiFilter* gpiFilters_{nullptr};
+  uint8_t gpiFiltersCount_ = 0;
+  TickSource gpiFilterTicks_{nullptr};
+  bool interruptReassert_ = true;
+  volatile bool interruptPending_ = false;
+  volatile bool awaitingWakeEvent_ = false;
+  volatile uint16_t wakeAt_ = 0;
+  uint16_t lastWakeLatency_ = 0;
+  uint16_t maxWakeLatency_ = 0;
+  TickSource wakeTicks_{nullptr};
+  InterruptRearmCallback interruptRearmCallback_{nullptr};
 };
 
 #endif
\ No newline at end of file